@@ -1,4 +1,5 @@
 #pragma once
+#include <algorithm>
 #include <cassert>
 #include <charconv>
 #include <iostream>
@@ -8,6 +9,18 @@
 #include <vector>
 using namespace std;
 
+enum Correction {
+  Holm,
+  BenjaminiHochberg,
+};
+
+enum CacheMode {
+  Uncontrolled,
+  Cold,
+  Warm,
+  Pinned,
+};
+
 enum HandleOutliners {
   Keep,
   Remove,
@@ -23,28 +36,57 @@ struct ColumnsIndexes {
   int std = -1;
   int samples = -1;
   int outliers = -1;
+  int warmup = -1;
+  int shape = -1;
+  int cache = -1;
 };
 
 struct Config {
   bool show_help = false;
+  bool self_check = false;
+
+  optional<string> synthetic;
+  double synthetic_seconds = 0;
 
   double min_seconds = 2.;
   int min_samples = 5;
 
   double min_warmup_seconds = .1;
   int min_warmup_samples = 1;
+  bool auto_warmup = false;
 
   double confidence = 0.95;
 
+  optional<double> detect;
+  double power = 0.8;
+  int pilot_samples = 10;
+  bool plan_only = false;
+
   optional<string> csv_file;
+  optional<string> bin_file;
+  optional<string> analyze_file;
 
   vector<const char*> column_names;
   ColumnsIndexes column;
 
   HandleOutliners outliers = HandleOutliners::Remove;
+  bool report_modes = false;
+
+  bool matrix = false;
+  Correction correction = Correction::Holm;
 
   vector<vector<const char*>> targets;
 
+  CacheMode cache = CacheMode::Uncontrolled;
+  vector<string> cache_files;
+
+  bool profile = false;
+  int profile_top = 10;
+  optional<string> folded_file;
+
+  vector<string> revisions;
+  optional<string> build_command;
+
   bool use_ascii = false;
   bool no_prefix = false;
 
@@ -72,9 +114,35 @@ struct Config {
         } else if (option_name == "help") {
           show_help = true;
           continue;
+        } else if (option_name == "self-check") {
+          self_check = true;
+          continue;
+        } else if (option_name == "synthetic") {
+          synthetic = argv[++arg_index];
+          string_view param = argv[++arg_index];
+          synthetic_seconds = parse_double(param);
+          continue;
         } else if (option_name == "keep-outlier") {
           outliers = HandleOutliners::Keep;
           continue;
+        } else if (option_name == "modes") {
+          report_modes = true;
+          continue;
+        } else if (option_name == "matrix") {
+          matrix = true;
+          continue;
+        } else if (option_name == "correction") {
+          string_view param = argv[++arg_index];
+          if (param == "holm")
+            correction = Correction::Holm;
+          else if (param == "bh")
+            correction = Correction::BenjaminiHochberg;
+          else {
+            cout << "Invalid correction '" << param;
+            cout << "' . Expected holm or bh" << endl;
+            exit(1);
+          }
+          continue;
         } else if (option_name == "no-prefix") {
           no_prefix = true;
           continue;
@@ -83,6 +151,48 @@ struct Config {
           if (argv[arg_index + 1][0] != '-')
             csv_file = argv[++arg_index];
           continue;
+        } else if (option_name == "bin") {
+          bin_file = argv[++arg_index];
+          continue;
+        } else if (option_name == "analyze") {
+          analyze_file = argv[++arg_index];
+          continue;
+        } else if (option_name == "cache") {
+          string_view param = argv[++arg_index];
+          if (param == "cold")
+            cache = CacheMode::Cold;
+          else if (param == "warm")
+            cache = CacheMode::Warm;
+          else if (param == "pinned")
+            cache = CacheMode::Pinned;
+          else {
+            cout << "Invalid cache mode '" << param;
+            cout << "' . Expected cold, warm or pinned" << endl;
+            exit(1);
+          }
+          continue;
+        } else if (option_name == "files") {
+          string_view param = argv[++arg_index];
+          for (string_view file : parse_list(param))
+            cache_files.emplace_back(file);
+          continue;
+        } else if (option_name == "profile") {
+          profile = true;
+          continue;
+        } else if (option_name == "profile-top") {
+          string_view param = argv[++arg_index];
+          profile_top = parse_uint(param);
+          continue;
+        } else if (option_name == "folded") {
+          folded_file = argv[++arg_index];
+          profile = true;
+          continue;
+        } else if (option_name == "rev") {
+          revisions.push_back(argv[++arg_index]);
+          continue;
+        } else if (option_name == "build") {
+          build_command = argv[++arg_index];
+          continue;
         } else if (option_name == "wt") {
           string_view param = argv[++arg_index];
           min_warmup_seconds = parse_double(param);
@@ -91,15 +201,31 @@ struct Config {
           string_view param = argv[++arg_index];
           min_warmup_samples = parse_uint(param);
           continue;
+        } else if (option_name == "auto-warmup") {
+          auto_warmup = true;
+          continue;
         } else if (option_name == "cols") {
           string_view param = argv[++arg_index];
           parse_columns(parse_list(param));
           continue;
         } else if (option_name == "conf") {
           string_view param = argv[++arg_index];
-          confidence = parse_double(param);
-          assert(0.5 <= confidence && confidence < 1.0);
-          confidence /= 100.;
+          confidence = parse_percentage(param);
+          continue;
+        } else if (option_name == "power") {
+          string_view param = argv[++arg_index];
+          power = parse_percentage(param);
+          continue;
+        } else if (option_name == "detect") {
+          string_view param = argv[++arg_index];
+          detect = parse_difference(param);
+          continue;
+        } else if (option_name == "pilot") {
+          string_view param = argv[++arg_index];
+          pilot_samples = max(2u, parse_uint(param));
+          continue;
+        } else if (option_name == "plan-only") {
+          plan_only = true;
           continue;
         }
       }
@@ -166,6 +292,28 @@ struct Config {
     return value;
   }
 
+  // Percentage in the range [50, 100)
+  double parse_percentage(const std::string_view& s) {
+    double value = parse_double(s);
+    if (value < 50. || value >= 100.) {
+      cout << "Invalid argument '" << s;
+      cout << "' . Expected a percentage between 50 and 100" << endl;
+      exit(1);
+    }
+    return value / 100.;
+  }
+
+  double parse_difference(const std::string_view& s) {
+    double value = parse_double(s);
+    if (value <= 0. || value >= 100.) {
+      cout << "Invalid argument '" << s;
+      cout << "' . Expected a percentage greater than 0 and less than 100"
+           << endl;
+      exit(1);
+    }
+    return value / 100.;
+  }
+
   void parse_switch_options(string_view& option_name) {
     if (option_name.empty())
       return;
@@ -212,6 +360,15 @@ struct Config {
       } else if (names[index] == "outliers") {
         column.outliers = index;
         column_names.push_back("Outliers");
+      } else if (names[index] == "warmup") {
+        column.warmup = index;
+        column_names.push_back("Warmup");
+      } else if (names[index] == "shape") {
+        column.shape = index;
+        column_names.push_back("Shape");
+      } else if (names[index] == "cache") {
+        column.cache = index;
+        column_names.push_back("Cache");
       } else {
         cout << "Invalid column name '" << names[index];
         cout << "' . Expected a positive integer" << endl;
@@ -223,19 +380,65 @@ struct Config {
 
 static const char* HELP =
     "Usage: bench [<options>] [-- <command>] [-- <command>] ...\n"
+    "       bench [<options>] --analyze <file>\n"
+    "       bench [<options>] --rev <rev> --rev <rev> [--build <cmd>] -- ...\n"
+    "\n"
+    "    --analyze <file>  Analyze the samples recorded with --csv or --bin\n"
+    "                      instead of executing commands.\n"
+    "    --rev <rev>       Run the commands inside a git worktree of <rev>.\n"
+    "                      Worktrees are cached in .git/bench/<commit>.\n"
+    "    --build <cmd>     Shell command that builds each revision once.\n"
+    "\n"
     "Stadistical Options:\n"
     "    --conf <%>       Statistical confidence of the lowerbound.\n"
     "    --keep-outliers  Do not remove outlier.\n"
+    "    --modes          Report the warmup, every mode and every regime\n"
+    "                     separately. With --cache, also the outlier samples\n"
+    "                     and their page cache residency.\n"
+    "    --matrix         Compare all pairs of commands and rank them.\n"
+    "    --correction <c> Correction of --matrix: holm (default) or bh.\n"
     "\n"
     "Sampling Options:\n"
     "    -t <secs>    Minimum seconds inverted in taking samples.\n"
     "    -n <num>     Minimum amount of samples.\n"
     "    --wt <secs>  Minimum seconds inverted in the warmup.\n"
     "    --wn <num>   Minimum amount of samples in the warmup.\n"
+    "    --auto-warmup  Detect the end of the warmup transient (MSER-5, or\n"
+    "                   MSER-1 under 100 samples) in the samples taken after\n"
+    "                   --wt and --wn, and discard it too.\n"
+    "    --cache <mode>  Page cache state of the executable, its shared\n"
+    "                    libraries and --files before each sample:\n"
+    "                      cold   - Evicted (posix_fadvise DONTNEED)\n"
+    "                      warm   - Read in advance\n"
+    "                      pinned - Locked in memory for the whole run\n"
+    "    --files <list>  Comma separeted list of input files for --cache.\n"
+    "\n"
+    "Planning Options:\n"
+    "    --detect <%>   Take a pilot, then take exactly the samples needed to\n"
+    "                   detect a difference of <%> of the slowest mean.\n"
+    "    --power <%>    Probability of detecting it (80 by default).\n"
+    "    --pilot <num>  Samples of the pilot (10 by default).\n"
+    "    --plan-only    Stop after showing the plan.\n"
+    "\n"
+    "Profiling Options:\n"
+    "    --profile          Sample the call stacks of the commands and show\n"
+    "                       the functions whose share changed the most.\n"
+    "    --profile-top <n>  Functions shown per command (10 by default).\n"
+    "    --folded <file>    Output the folded call stacks of --profile.\n"
+    "\n"
+    "Self Validation Options:\n"
+    "    --self-check   Check the statistics against reference values and\n"
+    "                   measure the overhead and jitter of the sampler.\n"
+    "    --synthetic <kind> <secs>  Calibrated target used by --self-check:\n"
+    "                      busy    - Busy loop of <secs>\n"
+    "                      sleep   - Sleep of <secs>\n"
+    "                      bimodal - Busy loop of <secs> or 3 times <secs>\n"
     "\n"
     "Display Options:\n"
     "    -a              Only use ASCII characters.\n"
     "    --csv [<file>]  Output a table of samples with csv format.\n"
+    "    --bin <file>    Output the samples, the warmup and the --cache\n"
+    "                    residency of each execution in binary format.\n"
     "    --no-prefix     Do not use metric prefixes (0.012s instead of 12ms)\n"
     "    --cols <list>   Comma separeted list of columns to show. Options:\n"
     "                      name       - Command name\n"
@@ -247,7 +450,11 @@ static const char* HELP =
     "                      std        - Standard deviation\n"
     "                      samples    - Number of usefull samples\n"
     "                      outliers   - Precentage of removed outliners\n"
+    "                      warmup     - Number of discarded warmup samples\n"
+    "                      shape      - Bimodality and changepoint warnings\n"
+    "                      cache      - Mean page cache residency of --cache\n"
     "\n"
     "Examples:\n"
     "    > bench -- bash -ic '' -- bash -c '' -- sh -c ''\n"
-    "    > bench --cols mean,std -- sleep 1\n";
+    "    > bench --cols mean,std -- sleep 1\n"
+    "    > bench --rev main --rev HEAD --build make -- .bin/bench -h\n";
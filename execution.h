@@ -9,10 +9,14 @@
 #include <sys/wait.h>
 #include <unistd.h>
 #include <chrono>
+#include <algorithm>
+#include <cerrno>
 #include <cstddef>
 #include <cstdlib>
 #include <cstring>
+#include <functional>
 #include <iostream>
+#include <optional>
 #include <string>
 #include <vector>
 using namespace std;
@@ -70,39 +74,146 @@ inline std::string executable_path(const std::string& executable) {
   return "";
 }
 
+// Run a command and return its standard output without the trailing newline
+inline optional<string> run_capture(const vector<const char*>& command,
+                                    bool quiet = false) {
+  int pipe_fds[2];
+  if (pipe(pipe_fds) < 0) {
+    perror("pipe");
+    exit(1);
+  }
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], STDOUT_FILENO);
+  posix_spawn_file_actions_addclose(&actions, pipe_fds[0]);
+  if (quiet)
+    posix_spawn_file_actions_adddup2(&actions, get_devnull(), STDERR_FILENO);
+
+  vector<const char*> argv = command;
+  argv.push_back(nullptr);
+
+  pid_t pid;
+  int result = posix_spawnp(&pid, argv[0], &actions, NULL,
+                            (char**)argv.data(), environ);
+  posix_spawn_file_actions_destroy(&actions);
+  close(pipe_fds[1]);
+
+  if (result != 0) {
+    close(pipe_fds[0]);
+    return nullopt;
+  }
+
+  string output;
+  char buffer[4096];
+  ssize_t count;
+  while ((count = read(pipe_fds[0], buffer, sizeof(buffer))) > 0)
+    output.append(buffer, count);
+  close(pipe_fds[0]);
+
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    return nullopt;
+
+  while (!output.empty() && output.back() == '\n')
+    output.pop_back();
+  return output;
+}
+
 class Target {
   string target_name;
   string exe_path;
+  string working_dir;
   vector<const char*> args;
+  vector<double> warmup;
   vector<double> samples;
+  size_t required_warmup = 0;
+  vector<double> residency;  // Of every execution, warmup included
 
  public:
-  Target(const vector<const char*>& arguments) : args(arguments) {
+  // When a working directory is given the command runs inside of it, and a
+  // relative executable path is resolved from it.
+  Target(const vector<const char*>& arguments,
+         const string& directory = "",
+         const string& label = "")
+      : working_dir(directory), args(arguments) {
     if (args.empty() || args.back() == nullptr) {
       cout << "Invalid target argument. Must provide at least an executable"
            << endl;
       exit(1);
     }
 
-    target_name = args[0];
+    target_name = label + args[0];
     for (int i = 1; i < args.size(); ++i)
       target_name = target_name + ' ' + args[i];
 
-    exe_path = executable_path(args[0]);
+    string executable = args[0];
+    if (!working_dir.empty() && executable.find('/') != string::npos &&
+        executable[0] != '/')
+      executable = working_dir + '/' + executable;
+
+    exe_path = executable_path(executable);
     args[0] = exe_path.c_str();
 
     args.push_back(nullptr);
   }
 
+  // Target with samples recorded by a previous run, it can not be executed
+  Target(const string& name,
+         vector<double> recorded,
+         vector<double> recorded_warmup = {},
+         size_t required_warmup_count = 0,
+         vector<double> recorded_residency = {})
+      : target_name(name),
+        warmup(move(recorded_warmup)),
+        samples(move(recorded)),
+        required_warmup(required_warmup_count),
+        residency(move(recorded_residency)) {}
+
   const vector<double>& time_samples() const { return samples; }
+  const vector<double>& warmup_samples() const { return warmup; }
+  // Executions run as warmup by --wn/--wt, before any re-split
+  size_t required_warmup_count() const { return required_warmup; }
+  const vector<double>& execution_residency() const { return residency; }
+
+  // Page cache residency of the files of the command before each sample,
+  // empty when the page cache is not controlled
+  vector<double> sample_residency() const {
+    if (residency.size() != warmup.size() + samples.size())
+      return {};
+    return vector<double>(residency.begin() + warmup.size(), residency.end());
+  }
+
+  // Page cache residency measured right before the next execution
+  void add_residency(double fraction) { residency.push_back(fraction); }
   const string& name() const { return target_name; }
+  const string& executable() const { return exe_path; }
 
-  void execute(bool record = true) {
+  // When given, `attach` is called with the pid of the child before it
+  // executes the command.
+  void execute(bool record = true,
+               const function<void(pid_t)>& attach = nullptr) {
     /*double seconds = execute_system();*/
-    double seconds = execute_posix();
+    double seconds = attach ? execute_attached(attach) : execute_posix();
 
-    if (record)
+    if (record) {
       samples.push_back(seconds);
+    } else {
+      warmup.push_back(seconds);
+      ++required_warmup;
+    }
+  }
+
+  // Re-split the recorded series (warmup followed by samples) so that the
+  // first `count` executions are treated as warmup.
+  void set_warmup_count(size_t count) {
+    vector<double> series = warmup;
+    series.insert(series.end(), samples.begin(), samples.end());
+
+    count = min(count, series.size());
+    warmup.assign(series.begin(), series.begin() + count);
+    samples.assign(series.begin() + count, series.end());
   }
 
  private:
@@ -122,10 +233,15 @@ class Target {
   }
 
   double execute_posix() {
+    // The target may have been moved since construction
+    args[0] = exe_path.c_str();
+
     posix_spawn_file_actions_t actions;
     posix_spawn_file_actions_init(&actions);
     posix_spawn_file_actions_adddup2(&actions, get_devnull(), STDOUT_FILENO);
     posix_spawn_file_actions_adddup2(&actions, get_devnull(), STDERR_FILENO);
+    if (!working_dir.empty())
+      posix_spawn_file_actions_addchdir_np(&actions, working_dir.c_str());
 
     pid_t pid;
     int result = posix_spawn(&pid, (char*)args[0], &actions, NULL,
@@ -142,4 +258,67 @@ class Target {
     waitpid(pid, &status, 0);
     return timer.seconds();
   }
+
+  // Slower version that holds the child until `attach` returns. As with
+  // posix_spawn, the timer starts once the command has been executed.
+  double execute_attached(const function<void(pid_t)>& attach) {
+    args[0] = exe_path.c_str();
+
+    // The child waits on `hold`, and reports exec errors through `failure`,
+    // which is closed on a successful exec
+    int hold[2], failure[2];
+    if (pipe(hold) < 0 || pipe2(failure, O_CLOEXEC) < 0) {
+      perror("pipe");
+      exit(1);
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      exit(1);
+    }
+
+    if (pid == 0) {
+      close(hold[1]);
+      close(failure[0]);
+      char go;
+      if (read(hold[0], &go, 1) == 1) {
+        dup2(get_devnull(), STDOUT_FILENO);
+        dup2(get_devnull(), STDERR_FILENO);
+        if (working_dir.empty() || chdir(working_dir.c_str()) == 0)
+          execv(args[0], (char**)args.data());
+      }
+      int error = errno;
+      if (write(failure[1], &error, sizeof(error)) != sizeof(error))
+        _exit(126);
+      _exit(127);
+    }
+
+    close(hold[0]);
+    close(failure[1]);
+    attach(pid);
+
+    if (write(hold[1], "", 1) != 1) {
+      perror("write");
+      exit(1);
+    }
+    close(hold[1]);
+
+    int error;
+    ssize_t failed = read(failure[0], &error, sizeof(error));
+    close(failure[0]);
+
+    Timer timer;
+    int status;
+    waitpid(pid, &status, 0);
+    double seconds = timer.seconds();
+
+    if (failed == sizeof(error)) {
+      cerr << "'" << name() << "' failed to execute" << endl;
+      errno = error;
+      perror(args[0]);
+      exit(1);
+    }
+    return seconds;
+  }
 };
@@ -1,10 +1,19 @@
 #include <algorithm>
 #include <cstdlib>
 #include <fstream>
+#include <iomanip>
+#include <memory>
+#include <optional>
+#include <sstream>
 #include <string>
 #include <vector>
 #include "config.h"
 #include "execution.h"
+#include "page_cache.h"
+#include "profiler.h"
+#include "recording.h"
+#include "revisions.h"
+#include "self_check.h"
 #include "statistics.h"
 #include "table.h"
 using namespace std;
@@ -12,39 +21,371 @@ using namespace std;
 void take_samples(vector<Target>& targets,
                   double min_secs,
                   long min_rep,
-                  bool record = true) {
+                  bool record = true,
+                  Profiler* profiler = nullptr,
+                  PageCache* cache = nullptr) {
   Timer timer;
   while (min_rep > 0 || timer.seconds() < min_secs) {
-    for (Target& target : targets)
-      target.execute(record);
+    for (int i = 0; i < targets.size(); ++i) {
+      if (cache)
+        targets[i].add_residency(cache->prepare(i));
+
+      if (profiler) {
+        targets[i].execute(record, [&](pid_t pid) { profiler->attach(pid); });
+        profiler->drain(i, record);
+      } else {
+        targets[i].execute(record);
+      }
+    }
     --min_rep;
   }
 }
 
-template <typename Vec, typename Mapper>
-void print_list(std::ostream& out, const Vec& elements, Mapper f) {
-  if (!elements.empty()) {
-    f(elements[0]);
-    for (int i = 1; i < elements.size(); ++i) {
-      out << ", ";
-      f(elements[i]);
+// Samples per target needed to detect a difference of config.detect, relative
+// to the slowest mean, from the variances observed in a pilot run.
+//
+// Returns nullopt when the difference can not be detected in a feasible run.
+optional<long> plan_samples(const Config& config,
+                            const vector<Target>& targets) {
+  vector<DataSet> pilot;
+  for (const Target& target : targets)
+    pilot.emplace_back(target.time_samples(), config.outliers);
+
+  int base_index = 0;
+  double round_seconds = 0;
+  for (int i = 0; i < pilot.size(); ++i) {
+    if (pilot[i].mean > pilot[base_index].mean)
+      base_index = i;
+    round_seconds += pilot[i].mean;
+  }
+
+  // A single target is planned against an identical one
+  const DataSet& base = pilot[base_index];
+  double effect = *config.detect * base.mean;
+  optional<long> samples = config.pilot_samples;
+  for (int i = 0; i < pilot.size() && samples; ++i) {
+    if (i != base_index || pilot.size() == 1) {
+      optional<long> needed = required_samples(
+          base, pilot[i], effect, config.confidence, config.power);
+      samples = needed ? max(*samples, *needed) : needed;
     }
-    out << endl;
   }
+
+  cout << "Pilot: " << config.pilot_samples << " samples per command" << endl;
+  cout << "Detecting a " << format(100. * *config.detect) << "% difference ("
+       << format(100. * config.confidence) << "% confidence, "
+       << format(100. * config.power) << "% power) ";
+  if (samples)
+    cout << "needs " << *samples << " samples per command, ~"
+         << format(*samples * round_seconds) << "s" << endl
+         << endl;
+  else
+    cout << "is infeasible: the pilot is too noisy for such a small "
+         << "difference" << endl;
+
+  return samples;
 }
 
-void export_csv(std::ostream& out, vector<Target>& targets) {
-  print_list(out, targets, [&](const Target& t) { out << t.name(); });
+double mean_residency(const vector<double>& residency) {
+  double sum = 0;
+  for (double x : residency)
+    sum += x;
+  return residency.empty() ? 0 : sum / residency.size();
+}
 
-  size_t rows = 0;
-  for (Target& target : targets)
-    rows = max(rows, target.time_samples().size());
+string shape_summary(const Bimodality& modes, const vector<size_t>& shifts) {
+  string summary;
+  if (modes.bimodal)
+    summary = "bimodal";
+  if (!shifts.empty()) {
+    if (!summary.empty())
+      summary += ", ";
+    summary += to_string(shifts.size());
+    summary += shifts.size() == 1 ? " mean shift" : " mean shifts";
+  }
+  return summary;
+}
+
+// Each regime of the samples separately. When the page cache is controlled,
+// also its residency, and the outlier samples with the residency each one
+// started with.
+void print_modes(const Config& config,
+                 MetricPrefix scale,
+                 const vector<Target>& targets,
+                 const vector<Bimodality>& modes,
+                 const vector<vector<size_t>>& shifts) {
+  bool cached = false;
+  for (const Target& target : targets)
+    cached = cached || !target.sample_residency().empty();
+
+  vector<const char*> header = {"Name", "Regime", "Mean", "Std", "Samples"};
+  if (cached)
+    header.push_back("Cache");
+  Table table(header);
+  const char* plus_minus = config.use_ascii ? "+/- " : "±";
+  int row = 0;
+
+  auto push_row = [&](const Target& target, const string& regime,
+                      const vector<double>& samples,
+                      const vector<double>& residency) {
+    DataSet set(samples, config.outliers);
+    table.push(0, target.name());
+    table.push(1, regime);
+    table.push(2, format(set.mean, scale) + 's');
+    table.push(3, plus_minus + format(set.sd, scale) + 's');
+    table.push(4, to_string(set.n));
+    if (!residency.empty())
+      table.push(5, format(100. * mean_residency(residency)) + '%');
+    table.fill_row(row++);
+  };
+
+  for (int i = 0; i < targets.size(); ++i) {
+    const vector<double>& samples = targets[i].time_samples();
+    const vector<double>& warmup = targets[i].warmup_samples();
+    vector<double> residency = targets[i].sample_residency();
+
+    // Slices of the residency, empty when there is none
+    auto residency_of = [&](size_t start, size_t end) {
+      if (residency.empty())
+        return vector<double>();
+      return vector<double>(residency.begin() + start,
+                            residency.begin() + end);
+    };
+
+    // Discarded warmup samples, kept for inspection
+    if (warmup.size() >= 2) {
+      vector<double> warmup_residency;
+      if (!residency.empty())
+        warmup_residency.assign(
+            targets[i].execution_residency().begin(),
+            targets[i].execution_residency().begin() + warmup.size());
+      push_row(targets[i], "warmup", warmup, warmup_residency);
+    }
+
+    if (modes[i].bimodal) {
+      vector<double> fast, slow, fast_residency, slow_residency;
+      for (size_t k = 0; k < samples.size(); ++k) {
+        bool is_fast = samples[k] < modes[i].threshold;
+        (is_fast ? fast : slow).push_back(samples[k]);
+        if (!residency.empty())
+          (is_fast ? fast_residency : slow_residency).push_back(residency[k]);
+      }
+      push_row(targets[i], "fast mode", fast, fast_residency);
+      push_row(targets[i], "slow mode", slow, slow_residency);
+    }
+
+    if (!shifts[i].empty()) {
+      size_t start = 0;
+      for (size_t k = 0; k <= shifts[i].size(); ++k) {
+        size_t end = k < shifts[i].size() ? shifts[i][k] : samples.size();
+        vector<double> segment(samples.begin() + start, samples.begin() + end);
+        push_row(targets[i],
+                 "samples " + to_string(start) + "-" + to_string(end - 1),
+                 segment, residency_of(start, end));
+        start = end;
+      }
+    }
+  }
+
+  if (row > 0) {
+    cout << endl;
+    table.print();
+  }
+
+  if (!cached)
+    return;
+
+  // Samples outside of the IQR fences, with the residency they started with
+  Table outliers({"Name", "Sample", "Time", "Cache"});
+  row = 0;
+  for (const Target& target : targets) {
+    const vector<double>& samples = target.time_samples();
+    vector<double> residency = target.sample_residency();
+    if (residency.empty() || samples.size() < 2)
+      continue;
+
+    vector<double> sorted = samples;
+    double Q1, Q3;
+    calculateQuartiles(sorted, Q1, Q3);
+    double IQR = Q3 - Q1;
+
+    for (size_t k = 0; k < samples.size(); ++k) {
+      if (samples[k] >= Q1 - 1.5 * IQR && samples[k] <= Q3 + 1.5 * IQR)
+        continue;
+      outliers.push(0, target.name());
+      outliers.push(1, to_string(k));
+      outliers.push(2, format(samples[k], scale) + 's');
+      outliers.push(3, format(100. * residency[k]) + '%');
+      outliers.fill_row(row++);
+    }
+  }
+
+  if (row > 0) {
+    cout << endl;
+    outliers.print();
+  }
+}
+
+string format_p_value(double p) {
+  if (p < 1e-4)
+    return "<0.0001";
+  std::ostringstream oss;
+  oss << fixed << setprecision(4) << p;
+  return oss.str();
+}
+
+// Letters of a group: a, b, ..., z, aa, ab, ...
+string group_label(int group) {
+  string label;
+  for (++group; group > 0; group = (group - 1) / 26)
+    label.insert(label.begin(), char('a' + (group - 1) % 26));
+  return label;
+}
+
+// Rank the targets by mean and compare every pair with a Welch's t-test.
+// Targets are grouped greedily in rank order: a target joins the current
+// group while it is statistically indistinguishable from the group's fastest
+// target.
+void print_matrix(const Config& config,
+                  MetricPrefix scale,
+                  const vector<Target>& targets,
+                  const vector<DataSet>& sets) {
+  int n = targets.size();
+  double alpha = 1. - config.confidence;
+
+  vector<int> rank(n);
+  for (int i = 0; i < n; ++i)
+    rank[i] = i;
+  sort(rank.begin(), rank.end(),
+       [&](int a, int b) { return sets[a].mean < sets[b].mean; });
+
+  vector<double> p_values;
+  for (int i = 0; i < n; ++i) {
+    for (int j = i + 1; j < n; ++j)
+      p_values.push_back(ttest_p_value(sets[rank[i]], sets[rank[j]]));
+  }
+
+  if (config.correction == Correction::Holm)
+    p_values = holm_correction(p_values);
+  else
+    p_values = benjamini_hochberg_correction(p_values);
+
+  vector<vector<double>> p(n, vector<double>(n, 1.));
+  for (int i = 0, k = 0; i < n; ++i) {
+    for (int j = i + 1; j < n; ++j, ++k)
+      p[i][j] = p[j][i] = p_values[k];
+  }
+
+  vector<int> group(n, 0);
+  for (int i = 1, leader = 0; i < n; ++i) {
+    group[i] = group[i - 1];
+    if (p[leader][i] < alpha) {
+      leader = i;
+      ++group[i];
+    }
+  }
+
+  // Ranking
+  Table ranking({"Rank", "Group", "Name", "Mean"});
+  for (int i = 0; i < n; ++i) {
+    ranking.push(0, to_string(i + 1));
+    ranking.push(1, group_label(group[i]));
+    ranking.push(2, targets[rank[i]].name());
+    ranking.push(3, format(sets[rank[i]].mean, scale) + 's');
+    ranking.fill_row(i);
+  }
+  cout << endl;
+  ranking.print();
+
+  // Adjusted p-values of every pair, indexed by rank
+  vector<string> labels = {"Rank"};
+  for (int i = 0; i < n; ++i)
+    labels.push_back(to_string(i + 1));
+  vector<const char*> header;
+  for (string& label : labels)
+    header.push_back(label.c_str());
+
+  Table matrix(header);
+  for (int i = 0; i < n; ++i) {
+    matrix.push(0, to_string(i + 1));
+    for (int j = 0; j < n; ++j) {
+      if (i == j)
+        matrix.push(j + 1, "-");
+      else
+        matrix.push(j + 1, format_p_value(p[i][j]) +
+                               (p[i][j] < alpha ? "*" : ""));
+    }
+    matrix.fill_row(i);
+  }
+  cout << endl;
+  matrix.print();
+
+  bool holm = config.correction == Correction::Holm;
+  cout << "* Significant at " << format(100. * alpha) << "% after ";
+  cout << (holm ? "Holm" : "Benjamini-Hochberg") << " correction" << endl;
+}
+
+// Functions whose share of samples changed the most between the base and
+// each other target
+void print_profiles(const vector<Target>& targets,
+                    const vector<Profile>& profiles,
+                    int base_index,
+                    int top) {
+  Table table({"Name", "Function", "Base", "Target", "Change"});
+  const Profile& base = profiles[base_index];
+  int row = 0;
+
+  auto percentage = [](double share) { return format(100. * share) + '%'; };
 
-  for (size_t i = 0; i < rows; ++i) {
-    print_list(out, targets, [&](const Target& t) {
-      if (i < t.time_samples().size())
-        out << t.time_samples()[i];
+  for (int i = 0; i < targets.size(); ++i) {
+    if (i == base_index)
+      continue;
+
+    vector<pair<double, string>> changes;
+    for (auto& [function, samples] : profiles[i].self) {
+      if (profiles[i].share(function) != base.share(function))
+        changes.emplace_back(profiles[i].share(function) - base.share(function),
+                             function);
+    }
+    for (auto& [function, samples] : base.self) {
+      if (!profiles[i].self.count(function))
+        changes.emplace_back(-base.share(function), function);
+    }
+
+    sort(changes.begin(), changes.end(), [](auto& a, auto& b) {
+      return fabs(a.first) > fabs(b.first);
     });
+    if (changes.size() > top)
+      changes.resize(top);
+
+    for (auto& [change, function] : changes) {
+      table.push(0, targets[i].name());
+      table.push(1, function);
+      table.push(2, percentage(base.share(function)));
+      table.push(3, percentage(profiles[i].share(function)));
+      table.push(4, (change > 0 ? "+" : "") + percentage(change));
+      table.fill_row(row++);
+    }
+  }
+
+  cout << endl << "Profile of '" << targets[base_index].name() << "' ("
+       << base.samples << " samples) as base" << endl;
+  for (int i = 0; i < targets.size(); ++i) {
+    if (profiles[i].lost > 0)
+      cout << "Warning: " << profiles[i].lost << " profile samples of '"
+           << targets[i].name() << "' were lost" << endl;
+  }
+  if (row > 0)
+    table.print();
+}
+
+// Folded stacks, with the target as root frame (flamegraph.pl format)
+void export_folded(std::ostream& out,
+                   const vector<Target>& targets,
+                   const vector<Profile>& profiles) {
+  for (int i = 0; i < targets.size(); ++i) {
+    for (auto& [stack, samples] : profiles[i].folded)
+      out << targets[i].name() << ';' << stack << ' ' << samples << endl;
   }
 }
 
@@ -53,24 +394,84 @@ int main(int argc, const char* argv[]) {
   Config config;
   config.parse_args(argc, argv);
 
-  if (config.show_help || config.targets.empty()) {
+  if (config.synthetic)
+    return run_synthetic(*config.synthetic, config.synthetic_seconds);
+
+  if (config.self_check)
+    return run_self_check(config) == 0 ? 0 : 1;
+
+  if (config.show_help || (config.targets.empty() && !config.analyze_file)) {
     cout << HELP;
     return 0;
   }
 
   vector<Target> targets;
-  for (auto& target : config.targets)
-    targets.emplace_back(target);
+  unique_ptr<Profiler> profiler;
+  unique_ptr<PageCache> cache;
+  if (config.analyze_file) {
+    targets = load_recording(*config.analyze_file);
+  } else {
+    if (config.revisions.empty()) {
+      for (auto& target : config.targets)
+        targets.emplace_back(target);
+    } else {
+      for (Revision& revision :
+           prepare_revisions(config.revisions, config.build_command)) {
+        for (auto& target : config.targets)
+          targets.emplace_back(target, revision.directory,
+                               revision.name + ": ");
+      }
+    }
 
-  // Execute
-  take_samples(targets, config.min_warmup_seconds, config.min_warmup_samples,
-               false);
-  take_samples(targets, config.min_seconds, config.min_samples);
+    if (config.profile)
+      profiler = make_unique<Profiler>(targets.size());
+    if (config.cache != CacheMode::Uncontrolled)
+      cache = make_unique<PageCache>(config.cache, config.cache_files, targets);
+
+    // Execute
+    take_samples(targets, config.min_warmup_seconds, config.min_warmup_samples,
+                 false, profiler.get(), cache.get());
+    if (config.detect) {
+      take_samples(targets, 0, config.pilot_samples, true, profiler.get(),
+                   cache.get());
+      optional<long> samples = plan_samples(config, targets);
+      if (!samples)
+        return 1;
+      if (config.plan_only)
+        return 0;
+      take_samples(targets, 0, *samples - config.pilot_samples, true,
+                   profiler.get(), cache.get());
+    } else {
+      take_samples(targets, config.min_seconds, config.min_samples, true,
+                   profiler.get(), cache.get());
+    }
+  }
+
+  if (config.auto_warmup) {
+    for (Target& target : targets) {
+      vector<double> series = target.warmup_samples();
+      const vector<double>& samples = target.time_samples();
+      series.insert(series.end(), samples.begin(), samples.end());
+
+      // The transient is searched after the warmup required by --wn/--wt,
+      // which is never given back to the samples
+      size_t required = min(target.required_warmup_count(), series.size());
+      vector<double> steady(series.begin() + required, series.end());
+      target.set_warmup_count(required + mser_truncation(steady));
+    }
+  }
 
   vector<DataSet> sets;
   for (Target& target : targets)
     sets.emplace_back(target.time_samples(), config.outliers);
 
+  vector<Bimodality> modes;
+  vector<vector<size_t>> shifts;
+  for (Target& target : targets) {
+    modes.emplace_back(target.time_samples());
+    shifts.push_back(changepoints(target.time_samples()));
+  }
+
   // Analyze
   int base_index = 0;
   for (int i = 0; i < sets.size(); ++i) {
@@ -124,6 +525,12 @@ int main(int argc, const char* argv[]) {
     }
   }
 
+  if (config.bin_file) {
+    std::ofstream file(*config.bin_file, ios::binary);
+    export_binary(file, targets);
+    file.close();
+  }
+
   // Write table
   for (int i = 0; i < targets.size(); ++i) {
     double min_gain = 0;
@@ -165,11 +572,43 @@ int main(int argc, const char* argv[]) {
     table.push(config.column.name, targets[i].name());
     table.push(config.column.mean, format(sets[i].mean, scale) + 's');
     table.push(config.column.samples, to_string(sets[i].n));
+    table.push(config.column.warmup,
+               to_string(targets[i].warmup_samples().size()));
+    table.push(config.column.shape, shape_summary(modes[i], shifts[i]));
+    vector<double> residency = targets[i].sample_residency();
+    if (!residency.empty())
+      table.push(config.column.cache,
+                 format(100. * mean_residency(residency)) + '%');
 
     table.fill_row(i);
   }
 
   table.print();
 
+  // Warn about samples that can not be summarized by a single mean
+  for (int i = 0; i < targets.size(); ++i) {
+    if (config.column.shape < 0 && !config.report_modes &&
+        (modes[i].bimodal || !shifts[i].empty())) {
+      cout << "Warning: '" << targets[i].name() << "' samples are not "
+           << "a single regime (" << shape_summary(modes[i], shifts[i])
+           << "). Use --modes to see each regime." << endl;
+    }
+  }
+
+  if (config.report_modes)
+    print_modes(config, scale, targets, modes, shifts);
+
+  if (config.matrix)
+    print_matrix(config, scale, targets, sets);
+
+  if (profiler) {
+    print_profiles(targets, profiler->profiles, base_index, config.profile_top);
+
+    if (config.folded_file) {
+      std::ofstream file(*config.folded_file);
+      export_folded(file, targets, profiler->profiles);
+    }
+  }
+
   return 0;
 }
@@ -0,0 +1,187 @@
+#pragma once
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "config.h"
+#include "execution.h"
+using namespace std;
+
+// Shared libraries the dynamic loader resolves for an executable, from ldd
+inline vector<string> resolve_dsos(const string& executable) {
+  vector<string> dsos;
+  optional<string> output = run_capture({"ldd", executable.c_str()}, true);
+  if (!output)
+    return dsos;
+
+  // "libc.so.6 => /lib/libc.so.6 (0x...)" or "/lib64/ld-linux.so.2 (0x...)"
+  istringstream lines(*output);
+  string line;
+  while (getline(lines, line)) {
+    size_t arrow = line.find("=> ");
+    size_t start = arrow == string::npos ? line.find('/') : arrow + 3;
+    if (start == string::npos || line[start] != '/')
+      continue;
+    size_t end = line.find(" (", start);
+    dsos.push_back(line.substr(start, end - start));
+  }
+  return dsos;
+}
+
+// A file whose page cache state is controlled
+class CachedFile {
+  string file_path;
+  size_t length = 0;
+  void* pinned = nullptr;
+
+ public:
+  CachedFile(const string& path) : file_path(path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0)
+      length = st.st_size;
+  }
+
+  CachedFile(CachedFile&& other)
+      : file_path(move(other.file_path)),
+        length(other.length),
+        pinned(other.pinned) {
+    other.pinned = nullptr;
+  }
+
+  CachedFile(const CachedFile&) = delete;
+  CachedFile& operator=(const CachedFile&) = delete;
+
+  ~CachedFile() {
+    if (pinned)
+      munmap(pinned, length);
+  }
+
+  // Drop the clean pages of the file that are not mapped by any process
+  void evict() const {
+    int fd = open(file_path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  }
+
+  // Bring the whole file into the page cache
+  void warm() const {
+    int fd = open(file_path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    static char buffer[1 << 16];
+    while (read(fd, buffer, sizeof(buffer)) > 0) {
+    }
+    close(fd);
+  }
+
+  // Keep the whole file resident until destruction
+  void pin() {
+    if (pinned || length == 0)
+      return;
+
+    int fd = open(file_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      perror(file_path.c_str());
+      return;
+    }
+
+    void* map = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+      perror(file_path.c_str());
+      return;
+    }
+
+    pinned = map;
+    if (mlock(pinned, length) != 0)
+      perror(("Unable to pin '" + file_path + "'").c_str());
+  }
+
+  // Resident pages and total pages of the file
+  pair<size_t, size_t> residency() const {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t pages = (length + page - 1) / page;
+    if (pages == 0)
+      return {0, 0};
+
+    void* map = pinned;
+    if (!map) {
+      int fd = open(file_path.c_str(), O_RDONLY);
+      if (fd < 0)
+        return {0, 0};
+      map = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+      close(fd);
+      if (map == MAP_FAILED)
+        return {0, 0};
+    }
+
+    vector<unsigned char> resident(pages);
+    size_t count = 0;
+    if (mincore(map, length, resident.data()) == 0) {
+      for (unsigned char page_state : resident)
+        count += page_state & 1;
+    }
+
+    if (map != pinned)
+      munmap(map, length);
+    return {count, pages};
+  }
+};
+
+// Page cache state of the executable, shared libraries and input files of
+// each target, set before every execution.
+class PageCache {
+  CacheMode mode;
+  vector<vector<CachedFile>> files;  // By target
+
+ public:
+  PageCache(CacheMode cache_mode,
+            const vector<string>& extra_files,
+            const vector<Target>& targets)
+      : mode(cache_mode), files(targets.size()) {
+    for (int i = 0; i < targets.size(); ++i) {
+      vector<string> paths = {targets[i].executable()};
+      for (string& dso : resolve_dsos(targets[i].executable()))
+        paths.push_back(dso);
+      paths.insert(paths.end(), extra_files.begin(), extra_files.end());
+
+      for (const string& path : paths) {
+        if (path.empty())
+          continue;
+        files[i].emplace_back(path);
+        if (mode == CacheMode::Pinned)
+          files[i].back().pin();
+      }
+    }
+  }
+
+  // Set the page cache state of the files of the target and return the
+  // fraction of their pages that is resident
+  double prepare(int target) {
+    for (const CachedFile& file : files[target]) {
+      if (mode == CacheMode::Cold)
+        file.evict();
+      else if (mode == CacheMode::Warm)
+        file.warm();
+    }
+
+    size_t resident = 0, pages = 0;
+    for (const CachedFile& file : files[target]) {
+      auto [file_resident, file_pages] = file.residency();
+      resident += file_resident;
+      pages += file_pages;
+    }
+    return pages ? double(resident) / pages : 1.;
+  }
+};
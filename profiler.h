@@ -0,0 +1,480 @@
+#pragma once
+#include <cxxabi.h>
+#include <elf.h>
+#include <linux/perf_event.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include "recording.h"
+using namespace std;
+
+// Samples of one target, by function name
+struct Profile {
+  uint64_t samples = 0;
+  uint64_t lost = 0;
+  map<string, uint64_t> self;    // Leaf function -> samples
+  map<string, uint64_t> folded;  // "outer;...;leaf" -> samples
+
+  double share(const string& function) const {
+    auto it = self.find(function);
+    if (it == self.end() || samples == 0)
+      return 0;
+    return double(it->second) / double(samples);
+  }
+};
+
+// Function symbols of an ELF file, addressed by file offset
+class ElfSymbols {
+  struct Symbol {
+    uint64_t address;
+    uint64_t size;
+    string name;
+  };
+
+  struct Segment {
+    uint64_t offset, size, address;
+  };
+
+  vector<Symbol> symbols;
+  vector<Segment> segments;
+
+ public:
+  ElfSymbols(const string& path) {
+    if (path.empty() || path[0] != '/' || access(path.c_str(), R_OK) != 0)
+      return;
+
+    MappedFile file(path);
+    string_view data = file.view();
+    if (data.size() < sizeof(Elf64_Ehdr) ||
+        memcmp(data.data(), ELFMAG, SELFMAG) != 0 ||
+        data[EI_CLASS] != ELFCLASS64)
+      return;
+
+    auto* ehdr = reinterpret_cast<const Elf64_Ehdr*>(data.data());
+    auto inside = [&](uint64_t offset, uint64_t size) {
+      return offset <= data.size() && size <= data.size() - offset;
+    };
+
+    if (!inside(ehdr->e_phoff, ehdr->e_phnum * sizeof(Elf64_Phdr)) ||
+        !inside(ehdr->e_shoff, ehdr->e_shnum * sizeof(Elf64_Shdr)))
+      return;
+
+    auto* phdrs =
+        reinterpret_cast<const Elf64_Phdr*>(data.data() + ehdr->e_phoff);
+    for (int i = 0; i < ehdr->e_phnum; ++i) {
+      if (phdrs[i].p_type == PT_LOAD)
+        segments.push_back(
+            {phdrs[i].p_offset, phdrs[i].p_filesz, phdrs[i].p_vaddr});
+    }
+
+    auto* shdrs =
+        reinterpret_cast<const Elf64_Shdr*>(data.data() + ehdr->e_shoff);
+    for (int i = 0; i < ehdr->e_shnum; ++i) {
+      const Elf64_Shdr& section = shdrs[i];
+      if (section.sh_type != SHT_SYMTAB && section.sh_type != SHT_DYNSYM)
+        continue;
+      if (section.sh_link >= ehdr->e_shnum)
+        continue;
+
+      const Elf64_Shdr& strtab = shdrs[section.sh_link];
+      if (!inside(section.sh_offset, section.sh_size) ||
+          !inside(strtab.sh_offset, strtab.sh_size))
+        continue;
+
+      auto* syms =
+          reinterpret_cast<const Elf64_Sym*>(data.data() + section.sh_offset);
+      size_t count = section.sh_size / sizeof(Elf64_Sym);
+      for (size_t s = 0; s < count; ++s) {
+        if (ELF64_ST_TYPE(syms[s].st_info) != STT_FUNC ||
+            syms[s].st_value == 0 || syms[s].st_name >= strtab.sh_size)
+          continue;
+
+        const char* name = data.data() + strtab.sh_offset + syms[s].st_name;
+        size_t length = strnlen(name, strtab.sh_size - syms[s].st_name);
+        string symbol = demangle(string(name, length));
+        symbols.push_back({syms[s].st_value, syms[s].st_size, symbol});
+      }
+    }
+
+    sort(symbols.begin(), symbols.end(), [](const Symbol& a, const Symbol& b) {
+      return a.address < b.address;
+    });
+  }
+
+  // Name of the function containing the given file offset
+  const string* lookup(uint64_t offset) const {
+    uint64_t address = 0;
+    bool found = false;
+    for (const Segment& segment : segments) {
+      if (segment.offset <= offset && offset < segment.offset + segment.size) {
+        address = offset - segment.offset + segment.address;
+        found = true;
+        break;
+      }
+    }
+    if (!found)
+      return nullptr;
+
+    auto it = upper_bound(symbols.begin(), symbols.end(), address,
+                          [](uint64_t addr, const Symbol& symbol) {
+                            return addr < symbol.address;
+                          });
+    if (it == symbols.begin())
+      return nullptr;
+    --it;
+
+    if (it->size != 0 && address >= it->address + it->size)
+      return nullptr;
+    return &it->name;
+  }
+
+ private:
+  static string demangle(const string& name) {
+    int status;
+    char* demangled =
+        abi::__cxa_demangle(name.c_str(), nullptr, nullptr, &status);
+    if (status != 0)
+      return name;
+
+    string result = demangled;
+    free(demangled);
+
+    // Drop the argument list, overloads are merged
+    size_t args = result.find('(');
+    if (args != string::npos && args > 0)
+      result.resize(args);
+    return result;
+  }
+};
+
+// Ring buffer of a sampling event opened on one cpu
+class RingBuffer {
+  static constexpr size_t DATA_PAGES = 128;
+
+  int fd = -1;
+  perf_event_mmap_page* header = nullptr;
+  const char* data = nullptr;
+  size_t data_size = 0;
+  size_t mmap_size = 0;
+
+ public:
+  RingBuffer(pid_t pid, int cpu) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.config = PERF_COUNT_SW_CPU_CLOCK;
+    attr.freq = 1;
+    attr.sample_freq = 1000;
+    attr.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME |
+                       PERF_SAMPLE_CALLCHAIN;
+    attr.sample_id_all = 1;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.inherit = 1;
+    attr.mmap = 1;
+    attr.comm = 1;
+    attr.task = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    // Wake up the reader when half of the buffer is used
+    size_t page = sysconf(_SC_PAGESIZE);
+    data_size = DATA_PAGES * page;
+    mmap_size = data_size + page;
+    attr.watermark = 1;
+    attr.wakeup_watermark = data_size / 2;
+
+    fd = syscall(SYS_perf_event_open, &attr, pid, cpu, -1, 0);
+    if (fd < 0)
+      return;
+
+    void* map =
+        mmap(nullptr, mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+      perror("Unable to map the profiler ring buffer");
+      exit(1);
+    }
+
+    header = static_cast<perf_event_mmap_page*>(map);
+    data = static_cast<const char*>(map) + page;
+  }
+
+  RingBuffer(RingBuffer&& other)
+      : fd(other.fd),
+        header(other.header),
+        data(other.data),
+        data_size(other.data_size),
+        mmap_size(other.mmap_size) {
+    other.fd = -1;
+    other.header = nullptr;
+  }
+
+  RingBuffer(const RingBuffer&) = delete;
+  RingBuffer& operator=(const RingBuffer&) = delete;
+
+  ~RingBuffer() {
+    if (header)
+      munmap(header, mmap_size);
+    if (fd >= 0)
+      close(fd);
+  }
+
+  bool is_open() const { return header != nullptr; }
+  int descriptor() const { return fd; }
+
+  // Move every pending record to the end of the given list
+  void read(vector<vector<char>>& records) {
+    uint64_t head = __atomic_load_n(&header->data_head, __ATOMIC_ACQUIRE);
+    uint64_t tail = header->data_tail;
+
+    while (tail < head) {
+      perf_event_header record_header;
+      copy_out(tail, &record_header, sizeof(record_header));
+      if (record_header.size < sizeof(record_header))
+        break;
+
+      records.emplace_back(record_header.size);
+      copy_out(tail, records.back().data(), record_header.size);
+      tail += record_header.size;
+    }
+
+    __atomic_store_n(&header->data_tail, head, __ATOMIC_RELEASE);
+  }
+
+ private:
+  void copy_out(uint64_t position, void* dest, size_t size) {
+    size_t offset = position % data_size;
+    size_t first = min(size, data_size - offset);
+    memcpy(dest, data + offset, first);
+    memcpy(static_cast<char*>(dest) + first, data, size - first);
+  }
+};
+
+// Sampling profiler of the spawned commands.
+//
+// Before each command is executed, a cpu-clock sampling event is opened on
+// the held child for every cpu, with inherit and enable_on_exec so that it
+// follows the whole process tree from the exec onwards. The kernel only
+// allows to map inherited events per cpu.
+//
+// Opening the events on bench itself would be cheaper, but perf swaps the
+// contexts of a parent and its just forked child on context switches, which
+// consumes the enable_on_exec of the original events after a few commands.
+//
+// While the command runs, a reader thread copies the records out of the ring
+// buffers whenever they are half full, so long commands do not lose their
+// later samples. The records are only symbolized once the child has exited,
+// outside of the timed region, in time order across the cpus: the mappings
+// of a process are inherited on fork and replaced on exec.
+class Profiler {
+  static constexpr size_t MAX_STACK = 64;
+
+  vector<RingBuffer> buffers;
+  vector<vector<char>> records;
+  thread reader;
+  int wake_fds[2] = {-1, -1};
+
+  struct Mapping {
+    uint64_t start, end, offset;
+    string file;
+  };
+
+  map<uint32_t, vector<Mapping>> mappings;  // By pid
+  map<string, ElfSymbols> symbols;          // By file
+
+ public:
+  vector<Profile> profiles;
+
+  Profiler(size_t targets) : profiles(targets) {}
+
+  void attach(pid_t pid) {
+    buffers.clear();
+
+    int cpus = sysconf(_SC_NPROCESSORS_CONF);
+    for (int cpu = 0; cpu < cpus; ++cpu) {
+      RingBuffer buffer(pid, cpu);
+      if (buffer.is_open())
+        buffers.push_back(move(buffer));
+    }
+
+    if (buffers.empty()) {
+      perror("Unable to open the sampling profiler (perf_event_open)");
+      cerr << "Check /proc/sys/kernel/perf_event_paranoid" << endl;
+      exit(1);
+    }
+
+    if (pipe(wake_fds) < 0) {
+      perror("pipe");
+      exit(1);
+    }
+    reader = thread(&Profiler::read_buffers, this);
+  }
+
+  // Consume every pending record. Samples are only added to the profile of
+  // the target when recording.
+  void drain(size_t target, bool record = true) {
+    if (write(wake_fds[1], "", 1) != 1) {
+      perror("write");
+      exit(1);
+    }
+    reader.join();
+    close(wake_fds[0]);
+    close(wake_fds[1]);
+
+    for (RingBuffer& buffer : buffers)
+      buffer.read(records);
+    buffers.clear();
+
+    // Each buffer is in time order, a process may migrate between cpus
+    stable_sort(records.begin(), records.end(),
+                [](const vector<char>& a, const vector<char>& b) {
+                  return record_time(a) < record_time(b);
+                });
+
+    for (vector<char>& entry : records) {
+      auto* header = reinterpret_cast<perf_event_header*>(entry.data());
+      const char* body = entry.data() + sizeof(perf_event_header);
+      if (header->type == PERF_RECORD_MMAP)
+        add_mapping(body);
+      else if (header->type == PERF_RECORD_FORK)
+        fork_mappings(body);
+      else if (header->type == PERF_RECORD_COMM &&
+               (header->misc & PERF_RECORD_MISC_COMM_EXEC))
+        mappings.erase(reinterpret_cast<const uint32_t*>(body)[0]);
+      else if (header->type == PERF_RECORD_LOST && record)
+        profiles[target].lost += reinterpret_cast<const uint64_t*>(body)[1];
+      else if (header->type == PERF_RECORD_SAMPLE && record)
+        add_sample(profiles[target], body);
+    }
+    records.clear();
+
+    // Every child has exited, their pids may be reused
+    mappings.clear();
+  }
+
+ private:
+  // Reader thread, runs from attach until drain wakes it up
+  void read_buffers() {
+    vector<pollfd> fds = {{wake_fds[0], POLLIN, 0}};
+    for (RingBuffer& buffer : buffers)
+      fds.push_back({buffer.descriptor(), POLLIN, 0});
+
+    while (true) {
+      if (poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR) {
+        perror("poll");
+        return;
+      }
+      if (fds[0].revents)
+        return;
+
+      // Once the process tree exits, the event stays readable forever
+      for (size_t i = 1; i < fds.size(); ++i) {
+        if (fds[i].revents & POLLHUP)
+          fds[i].fd = -1;
+      }
+
+      for (RingBuffer& buffer : buffers)
+        buffer.read(records);
+    }
+  }
+
+  // Timestamp of a record. With sample_id_all, records other than samples
+  // end with their sample_id, whose last field is the time.
+  static uint64_t record_time(const vector<char>& entry) {
+    auto* header = reinterpret_cast<const perf_event_header*>(entry.data());
+    size_t at = header->type == PERF_RECORD_SAMPLE
+                    ? sizeof(perf_event_header) + 16
+                    : entry.size() - sizeof(uint64_t);
+
+    uint64_t time;
+    memcpy(&time, entry.data() + at, sizeof(time));
+    return time;
+  }
+
+  void add_mapping(const char* body) {
+    struct MmapRecord {
+      uint32_t pid, tid;
+      uint64_t addr, len, pgoff;
+      char filename[];
+    };
+    auto* record = reinterpret_cast<const MmapRecord*>(body);
+    mappings[record->pid].push_back({record->addr, record->addr + record->len,
+                                     record->pgoff, record->filename});
+  }
+
+  // A forked process starts with a copy of the mappings of its parent
+  void fork_mappings(const char* body) {
+    struct ForkRecord {
+      uint32_t pid, ppid, tid, ptid;
+    };
+    auto* record = reinterpret_cast<const ForkRecord*>(body);
+    if (record->pid != record->ppid && mappings.count(record->ppid))
+      mappings[record->pid] = mappings[record->ppid];
+  }
+
+  string symbolize(uint32_t pid, uint64_t ip) {
+    // Later mappings replace earlier ones over the same range
+    vector<Mapping>& process = mappings[pid];
+    for (auto mapping = process.rbegin(); mapping != process.rend();
+         ++mapping) {
+      if (ip < mapping->start || ip >= mapping->end)
+        continue;
+
+      auto it = symbols.find(mapping->file);
+      if (it == symbols.end())
+        it = symbols.emplace(mapping->file, ElfSymbols(mapping->file)).first;
+
+      uint64_t offset = ip - mapping->start + mapping->offset;
+      const string* name = it->second.lookup(offset);
+      if (name)
+        return *name;
+
+      // Anonymous mappings like [vdso] are already named so
+      if (mapping->file[0] == '[')
+        return mapping->file;
+      size_t slash = mapping->file.rfind('/');
+      return '[' + mapping->file.substr(slash + 1) + ']';
+    }
+    return "[unknown]";
+  }
+
+  void add_sample(Profile& profile, const char* body) {
+    struct SampleRecord {
+      uint64_t ip;
+      uint32_t pid, tid;
+      uint64_t time;
+      uint64_t nr;
+      uint64_t ips[];
+    };
+    auto* record = reinterpret_cast<const SampleRecord*>(body);
+
+    // The callchain starts with the sampled ip and contains context markers
+    vector<string> stack;
+    for (uint64_t i = 0; i < record->nr && stack.size() < MAX_STACK; ++i) {
+      if (record->ips[i] >= PERF_CONTEXT_MAX)
+        continue;
+      stack.push_back(symbolize(record->pid, record->ips[i]));
+    }
+    if (stack.empty())
+      stack.push_back(symbolize(record->pid, record->ip));
+
+    string folded = stack.back();
+    for (size_t i = stack.size() - 1; i-- > 0;)
+      folded += ';' + stack[i];
+
+    ++profile.samples;
+    ++profile.self[stack.front()];
+    ++profile.folded[folded];
+  }
+};
@@ -0,0 +1,310 @@
+#pragma once
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "execution.h"
+using namespace std;
+
+// Binary dump layout (native endianness):
+//   "BENCHBIN" u32:targets {
+//     u32:name_length name u64:samples f64[samples]
+//     u64:warmup f64[warmup] u64:required_warmup
+//     u64:residency f64[residency]
+//   }*
+// The page cache residency is of every execution, warmup first, or empty.
+static const char BINARY_MAGIC[8] = {'B', 'E', 'N', 'C', 'H', 'B', 'I', 'N'};
+
+template <typename Vec, typename Mapper>
+void print_list(std::ostream& out, const Vec& elements, Mapper f) {
+  if (!elements.empty()) {
+    f(elements[0]);
+    for (int i = 1; i < elements.size(); ++i) {
+      out << ", ";
+      f(elements[i]);
+    }
+    out << endl;
+  }
+}
+
+// Names with a comma or a quote are quoted, with quotes doubled
+inline string csv_field(const string& name) {
+  if (name.find_first_of(",\"") == string::npos)
+    return name;
+
+  string field = "\"";
+  for (char c : name)
+    field += c == '"' ? "\"\"" : string(1, c);
+  return field + '"';
+}
+
+inline void export_csv(std::ostream& out, const vector<Target>& targets) {
+  print_list(out, targets,
+             [&](const Target& t) { out << csv_field(t.name()); });
+
+  // Enough digits for --analyze to read back the exact samples
+  streamsize precision = out.precision(numeric_limits<double>::max_digits10);
+
+  size_t rows = 0;
+  for (const Target& target : targets)
+    rows = max(rows, target.time_samples().size());
+
+  for (size_t i = 0; i < rows; ++i) {
+    print_list(out, targets, [&](const Target& t) {
+      if (i < t.time_samples().size())
+        out << t.time_samples()[i];
+    });
+  }
+  out.precision(precision);
+}
+
+inline void export_binary(std::ostream& out, const vector<Target>& targets) {
+  auto write = [&](const auto& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+  };
+
+  out.write(BINARY_MAGIC, sizeof(BINARY_MAGIC));
+  write(uint32_t(targets.size()));
+  for (const Target& target : targets) {
+    write(uint32_t(target.name().size()));
+    out.write(target.name().data(), target.name().size());
+
+    for (auto* series : {&target.time_samples(), &target.warmup_samples()}) {
+      write(uint64_t(series->size()));
+      out.write(reinterpret_cast<const char*>(series->data()),
+                series->size() * sizeof(double));
+    }
+    write(uint64_t(target.required_warmup_count()));
+
+    const vector<double>& residency = target.execution_residency();
+    write(uint64_t(residency.size()));
+    out.write(reinterpret_cast<const char*>(residency.data()),
+              residency.size() * sizeof(double));
+  }
+}
+
+// Read only memory mapping of a whole file
+class MappedFile {
+  const char* data = nullptr;
+  size_t length = 0;
+
+ public:
+  MappedFile(const string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      perror(path.c_str());
+      exit(1);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+      perror(path.c_str());
+      exit(1);
+    }
+
+    length = st.st_size;
+    if (length > 0) {
+      void* map = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map == MAP_FAILED) {
+        perror(path.c_str());
+        exit(1);
+      }
+      madvise(map, length, MADV_SEQUENTIAL);
+      data = static_cast<const char*>(map);
+    }
+    close(fd);
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  ~MappedFile() {
+    if (data)
+      munmap(const_cast<char*>(data), length);
+  }
+
+  string_view view() const { return string_view(data, length); }
+};
+
+inline void invalid_recording(const string& path, const string& reason) {
+  cerr << "Invalid recording '" << path << "': " << reason << endl;
+  exit(1);
+}
+
+inline vector<Target> load_binary(const string& path, string_view file) {
+  size_t offset = sizeof(BINARY_MAGIC);
+  auto read = [&](auto& value) {
+    if (file.size() - offset < sizeof(value))
+      invalid_recording(path, "truncated file");
+    memcpy(&value, file.data() + offset, sizeof(value));
+    offset += sizeof(value);
+  };
+  auto read_series = [&]() {
+    uint64_t count;
+    read(count);
+    if ((file.size() - offset) / sizeof(double) < count)
+      invalid_recording(path, "truncated file");
+    vector<double> series(count);
+    memcpy(series.data(), file.data() + offset, count * sizeof(double));
+    offset += count * sizeof(double);
+    return series;
+  };
+
+  uint32_t count;
+  read(count);
+
+  vector<Target> targets;
+  for (uint32_t t = 0; t < count; ++t) {
+    uint32_t name_length;
+    read(name_length);
+    if (file.size() - offset < name_length)
+      invalid_recording(path, "truncated file");
+    string name(file.substr(offset, name_length));
+    offset += name_length;
+
+    vector<double> samples = read_series();
+    vector<double> warmup = read_series();
+    uint64_t required_warmup;
+    read(required_warmup);
+    vector<double> residency = read_series();
+
+    if (samples.size() < 2)
+      invalid_recording(path, "'" + name + "' has fewer than 2 samples");
+    targets.emplace_back(name, move(samples), move(warmup), required_warmup,
+                         move(residency));
+  }
+  return targets;
+}
+
+// Parse the rows of an export_csv table. Each thread parses a chunk of whole
+// lines into its own columns, which are then concatenated in file order.
+inline vector<Target> load_csv(const string& path, string_view file) {
+  size_t header_end = min(file.find('\n'), file.size());
+  string_view header = file.substr(0, header_end);
+  string_view body = file.substr(min(header_end + 1, file.size()));
+
+  if (header.empty())
+    invalid_recording(path, "missing header");
+
+  // Names are separated by ", ", see csv_field for the quoting
+  vector<string> names;
+  for (size_t start = 0; start <= header.size();) {
+    string name;
+    size_t end;
+    if (start < header.size() && header[start] == '"') {
+      for (end = start + 1;; ++end) {
+        if (end >= header.size())
+          invalid_recording(path, "unterminated quoted name");
+        if (header[end] == '"' && header.substr(end, 2) != "\"\"")
+          break;
+        name += header[end];
+        end += header[end] == '"';
+      }
+      if (++end < header.size() && header.substr(end, 2) != ", ")
+        invalid_recording(path, "invalid quoted name");
+    } else {
+      end = min(header.find(", ", start), header.size());
+      name = header.substr(start, end - start);
+    }
+    names.push_back(name);
+    start = end + 2;
+  }
+
+  // Only split big files, thread creation is not free
+  constexpr size_t MIN_CHUNK = 1 << 20;
+  size_t threads = max<size_t>(1, thread::hardware_concurrency());
+  threads = max<size_t>(1, min(threads, body.size() / MIN_CHUNK));
+
+  vector<size_t> bounds = {0};
+  for (size_t t = 1; t < threads; ++t) {
+    size_t at = body.find('\n', max(bounds.back(), t * body.size() / threads));
+    bounds.push_back(at == string_view::npos ? body.size() : at + 1);
+  }
+  bounds.push_back(body.size());
+
+  vector<vector<vector<double>>> columns(
+      threads, vector<vector<double>>(names.size()));
+  vector<const char*> errors(threads, nullptr);
+
+  auto parse = [&](size_t t) {
+    const char* p = body.data() + bounds[t];
+    const char* end = body.data() + bounds[t + 1];
+    size_t col = 0;
+
+    while (p < end) {
+      while (p < end && *p == ' ')
+        ++p;
+
+      if (p < end && *p != ',' && *p != '\n') {
+        double value;
+        auto [next, ec] = from_chars(p, end, value);
+        if (ec != errc() || col >= names.size()) {
+          errors[t] = ec != errc() ? "invalid number" : "too many columns";
+          return;
+        }
+        columns[t][col].push_back(value);
+        p = next;
+      }
+
+      while (p < end && *p == ' ')
+        ++p;
+      if (p < end && *p == ',') {
+        ++col;
+        ++p;
+      } else if (p < end && *p == '\n') {
+        col = 0;
+        ++p;
+      } else if (p < end) {
+        errors[t] = "invalid number";
+        return;
+      }
+    }
+  };
+
+  vector<thread> workers;
+  for (size_t t = 1; t < threads; ++t)
+    workers.emplace_back(parse, t);
+  parse(0);
+  for (thread& worker : workers)
+    worker.join();
+
+  for (const char* error : errors) {
+    if (error)
+      invalid_recording(path, error);
+  }
+
+  vector<Target> targets;
+  for (size_t col = 0; col < names.size(); ++col) {
+    vector<double> samples;
+    for (size_t t = 0; t < threads; ++t)
+      samples.insert(samples.end(), columns[t][col].begin(),
+                     columns[t][col].end());
+
+    if (samples.size() < 2)
+      invalid_recording(path, "'" + names[col] + "' has fewer than 2 samples");
+    targets.emplace_back(names[col], move(samples));
+  }
+  return targets;
+}
+
+// Load the targets of a recording made with --csv or --bin
+inline vector<Target> load_recording(const string& path) {
+  MappedFile file(path);
+  string_view data = file.view();
+
+  if (data.substr(0, sizeof(BINARY_MAGIC)) ==
+      string_view(BINARY_MAGIC, sizeof(BINARY_MAGIC)))
+    return load_binary(path, data);
+  return load_csv(path, data);
+}
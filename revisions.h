@@ -0,0 +1,156 @@
+#pragma once
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+#include "execution.h"
+using namespace std;
+
+// A git revision checked out in its own worktree
+struct Revision {
+  string name;
+  string commit;
+  string directory;
+  bool cached = false;
+};
+
+inline bool file_exists(const string& path) {
+  struct stat st;
+  return stat(path.c_str(), &st) == 0;
+}
+
+inline string read_file(const string& path) {
+  ifstream file(path);
+  return string(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+}
+
+// Run the build command inside the worktree with its output sent to a log
+inline bool build_revision(const Revision& revision,
+                           const string& command,
+                           const string& log_path) {
+  int log = open(log_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (log < 0) {
+    perror(log_path.c_str());
+    return false;
+  }
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, log, STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, log, STDERR_FILENO);
+  posix_spawn_file_actions_addchdir_np(&actions, revision.directory.c_str());
+
+  const char* argv[] = {"/bin/sh", "-c", command.c_str(), nullptr};
+
+  pid_t pid;
+  int result = posix_spawn(&pid, argv[0], &actions, NULL, (char**)argv,
+                           environ);
+  posix_spawn_file_actions_destroy(&actions);
+  close(log);
+
+  if (result != 0)
+    return false;
+
+  int status;
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Check out every revision in a detached worktree and build them in parallel.
+//
+// Worktrees live in <git-common-dir>/bench/<commit>, so a commit is only
+// checked out and built once: later runs with the same build command reuse
+// the build artifacts. The build command and log are kept next to the
+// worktree, in <commit>.built and <commit>.log, out of reach of the build.
+inline vector<Revision> prepare_revisions(const vector<string>& names,
+                                          const optional<string>& build) {
+  optional<string> git_dir =
+      run_capture({"git", "rev-parse", "--git-common-dir"});
+  if (!git_dir) {
+    cerr << "--rev must be used inside of a git repository" << endl;
+    exit(1);
+  }
+
+  char resolved[PATH_MAX];
+  if (!realpath(git_dir->c_str(), resolved)) {
+    perror(git_dir->c_str());
+    exit(1);
+  }
+  string cache_dir = string(resolved) + "/bench";
+  mkdir(cache_dir.c_str(), 0755);
+
+  vector<Revision> revisions;
+  for (const string& name : names) {
+    Revision revision;
+    revision.name = name;
+
+    string spec = name + "^{commit}";
+    optional<string> commit =
+        run_capture({"git", "rev-parse", "--verify", "--quiet", spec.c_str()});
+    if (!commit) {
+      cerr << "Unknown git revision '" << name << "'" << endl;
+      exit(1);
+    }
+    revision.commit = *commit;
+    revision.directory = cache_dir + '/' + revision.commit;
+    string marker = revision.directory + ".built";
+    revision.cached =
+        build && file_exists(marker) && read_file(marker) == *build;
+
+    // Worktrees are created one by one, git locks its admin files
+    if (!file_exists(revision.directory)) {
+      auto added =
+          run_capture({"git", "worktree", "add", "--detach", "--quiet",
+                       revision.directory.c_str(), revision.commit.c_str()});
+      if (!added) {
+        cerr << "Unable to create a worktree for '" << name << "'" << endl;
+        exit(1);
+      }
+    }
+
+    revisions.push_back(revision);
+  }
+
+  if (!build)
+    return revisions;
+
+  vector<char> built(revisions.size(), true);
+  vector<thread> builders;
+  for (size_t i = 0; i < revisions.size(); ++i) {
+    // The same commit may be given twice, only build it once
+    bool duplicate = false;
+    for (size_t j = 0; j < i; ++j)
+      duplicate = duplicate || revisions[j].commit == revisions[i].commit;
+
+    if (revisions[i].cached || duplicate)
+      continue;
+
+    builders.emplace_back([&, i]() {
+      const Revision& revision = revisions[i];
+      string log = revision.directory + ".log";
+      built[i] = build_revision(revision, *build, log);
+      if (built[i])
+        ofstream(revision.directory + ".built") << *build;
+    });
+  }
+  for (thread& builder : builders)
+    builder.join();
+
+  for (size_t i = 0; i < revisions.size(); ++i) {
+    if (!built[i]) {
+      cerr << "Build of '" << revisions[i].name << "' failed. See "
+           << revisions[i].directory << ".log" << endl;
+      exit(1);
+    }
+  }
+
+  return revisions;
+}
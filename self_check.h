@@ -0,0 +1,317 @@
+#pragma once
+#include <time.h>
+#include <unistd.h>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "config.h"
+#include "execution.h"
+#include "statistics.h"
+#include "table.h"
+#include "t_quantile.h"
+using namespace std;
+
+inline void busy_wait(double seconds) {
+  Timer timer;
+  while (timer.seconds() < seconds) {
+  }
+}
+
+// Calibrated commands used by the self check, run as `bench --synthetic`
+inline int run_synthetic(const string& kind, double seconds) {
+  if (kind == "busy") {
+    busy_wait(seconds);
+  } else if (kind == "sleep") {
+    timespec duration;
+    duration.tv_sec = time_t(seconds);
+    duration.tv_nsec = long((seconds - duration.tv_sec) * 1e9);
+    nanosleep(&duration, nullptr);
+  } else if (kind == "bimodal") {
+    // Half of the executions take three times longer
+    auto now = chrono::high_resolution_clock::now();
+    mt19937_64 rng(now.time_since_epoch().count() ^ getpid());
+    busy_wait(rng() % 2 ? 3. * seconds : seconds);
+  } else {
+    cerr << "Unknown synthetic target '" << kind << "'" << endl;
+    return 1;
+  }
+  return 0;
+}
+
+// Normal noise from Box-Muller over the raw output of mt19937_64, which the
+// standard fixes, unlike normal_distribution. Simulations give the same
+// results with every standard library.
+class NormalNoise {
+  mt19937_64& rng;
+  double mean, sd;
+
+ public:
+  NormalNoise(mt19937_64& generator, double mu, double sigma)
+      : rng(generator), mean(mu), sd(sigma) {}
+
+  double operator()() {
+    double u1 = double((rng() >> 11) + 1) * 0x1.0p-53;  // (0, 1]
+    double u2 = double(rng() >> 11) * 0x1.0p-53;        // [0, 1)
+    return mean + sd * sqrt(-2. * log(u1)) * cos(2. * M_PI * u2);
+  }
+};
+
+class SelfCheck {
+  Table table = Table({"Check", "Expected", "Measured", "Result"});
+  int row = 0;
+  int failures = 0;
+
+ public:
+  void expect(const string& check,
+              double expected,
+              double measured,
+              double tolerance) {
+    bool ok = fabs(expected - measured) <= tolerance;
+    push(check, format_number(expected), format_number(measured), ok);
+  }
+
+  void expect_range(const string& check,
+                    double low,
+                    double high,
+                    double measured) {
+    bool ok = low <= measured && measured <= high;
+    string range = format_number(low) + " - " + format_number(high);
+    push(check, range, format_number(measured), ok);
+  }
+
+  void push(const string& check,
+            const string& expected,
+            const string& measured,
+            bool ok) {
+    table.push(0, check);
+    table.push(1, expected);
+    table.push(2, measured);
+    table.push(3, ok ? "ok" : "FAIL");
+    table.fill_row(row++);
+    failures += !ok;
+  }
+
+  int finish() {
+    table.print();
+    return failures;
+  }
+
+ private:
+  static string format_number(double x) {
+    std::ostringstream oss;
+    oss << setprecision(6) << x;
+    return oss.str();
+  }
+};
+
+// Statistics against reference values computed with R, and against
+// simulations with known answers
+inline int check_statistics(double confidence) {
+  SelfCheck check;
+
+  // qt(p, df)
+  check.expect("t_quantile(0.95, 8)", 1.859548, t_quantile(0.95, 8), 1e-4);
+  check.expect("t_quantile(0.95, 10)", 1.812461, t_quantile(0.95, 10), 1e-4);
+  check.expect("t_quantile(0.975, 5)", 2.570582, t_quantile(0.975, 5), 1e-4);
+  check.expect("t_quantile(0.99, 30)", 2.457262, t_quantile(0.99, 30), 1e-4);
+  check.expect("t_quantile(0.95, 1000)", 1.646379, t_quantile(0.95, 1000),
+               1e-4);
+  check.expect("t_quantile(0.95, 1e5)", 1.644869, t_quantile(0.95, 1e5),
+               1e-5);
+  check.expect("t_quantile(0.975, 1e6)", 1.959966, t_quantile(0.975, 1e6),
+               1e-5);
+  check.expect("t_quantile(0.99, 1e7)", 2.326348, t_quantile(0.99, 1e7),
+               1e-5);
+
+  DataSet x({10, 11, 12, 13, 14}, HandleOutliners::Keep);
+  DataSet y({8, 9, 10, 11, 12}, HandleOutliners::Keep);
+  check.expect("ttest_lower_bound", 0.1404521,
+               ttest_lower_bound(x, y, 0.95), 1e-4);
+  check.expect("ttest_p_value", 0.0805162, ttest_p_value(x, y), 1e-4);
+
+  DataSet outliers({1, 2, 3, 4, 5, 6, 7, 8, 9, 100}, HandleOutliners::Remove);
+  check.expect("removeOutliersIQR removed", 1, outliers.outliers, 0);
+  check.expect("removeOutliersIQR mean", 5, outliers.mean, 1e-9);
+
+  vector<double> p = {0.01, 0.04, 0.03, 0.005};
+  vector<double> holm = holm_correction(p);
+  vector<double> bh = benjamini_hochberg_correction(p);
+  check.expect("holm_correction(0.03)", 0.06, holm[2], 1e-9);
+  check.expect("holm_correction(0.005)", 0.02, holm[3], 1e-9);
+  check.expect("benjamini_hochberg(0.01)", 0.02, bh[0], 1e-9);
+  check.expect("benjamini_hochberg(0.03)", 0.04, bh[2], 1e-9);
+
+  // Fixed point of n = (qt(0.95, df) + qt(0.8, df))^2 * 2 / d^2 with
+  // df = 2 (n - 1), not a power.t.test result, which uses the noncentral t
+  DataSet unit({0, 2}, HandleOutliners::Keep);
+  unit.sd = 1;
+  check.expect("required_samples(d=1, sd=1)", 14,
+               required_samples(unit, unit, 1, 0.95, 0.8).value_or(-1), 0);
+  check.expect("required_samples(d=0.01, sd=1)", 123652,
+               required_samples(unit, unit, 0.01, 0.95, 0.8).value_or(-1), 0);
+
+  // A/A comparisons of normal samples: the lower bound of the difference
+  // should only be positive in a (1 - confidence) fraction of them
+  constexpr int TRIALS = 4000;
+  mt19937_64 rng(42);
+  NormalNoise normal(rng, 1., 0.1);
+  int false_positives = 0;
+  int removed = 0, close = 0;
+  for (int t = 0; t < TRIALS; ++t) {
+    vector<double> a(20), b(20), transient(200);
+    for (double& v : a)
+      v = normal();
+    for (double& v : b)
+      v = normal();
+    DataSet set_a(a, HandleOutliners::Keep), set_b(b, HandleOutliners::Keep);
+    false_positives += ttest_lower_bound(set_a, set_b, confidence) > 0;
+
+    // Warmup transient of 20 samples, 50% slower. MSER errs on the side of
+    // discarding too much, but should rarely discard more than twice as much.
+    if (t < 1000) {
+      for (int i = 0; i < transient.size(); ++i)
+        transient[i] = normal() + (i < 20 ? 0.5 : 0.);
+      size_t d = mser_truncation(transient);
+      removed += d >= 20;
+      close += 20 <= d && d <= 40;
+    }
+  }
+
+  double alpha = 1. - confidence;
+  double margin = 4. * sqrt(alpha * (1 - alpha) / TRIALS);
+  check.expect_range("A/A false positive rate", alpha - margin, alpha + margin,
+                     double(false_positives) / TRIALS);
+  check.expect_range("mser_truncation removes 20", 0.99, 1, removed / 1000.);
+  check.expect_range("mser_truncation within 40", 0.8, 1, close / 1000.);
+
+  // Bimodality of unimodal and of 1:3 mixture samples
+  int unimodal = 0, bimodal = 0;
+  for (int t = 0; t < 200; ++t) {
+    vector<double> single(50), mixture(50);
+    for (double& v : single)
+      v = normal();
+    for (double& v : mixture) {
+      v = normal();
+      v *= rng() % 2 ? 3. : 1.;
+    }
+    unimodal += Bimodality(single).bimodal;
+    bimodal += Bimodality(mixture).bimodal;
+  }
+  check.expect_range("Bimodality of normal", 0, 0.05, unimodal / 200.);
+  check.expect_range("Bimodality of mixture", 0.95, 1, bimodal / 200.);
+
+  return check.finish();
+}
+
+// Overhead and jitter of the harness, measured on calibrated targets, and
+// the false positive rate of A/A comparisons of real executions.
+//
+// Returns the number of failed checks.
+inline int check_harness(const Config& config, const string& self) {
+  struct Synthetic {
+    const char* kind;
+    double seconds;
+  };
+  const Synthetic synthetics[] = {
+      {"busy", 0}, {"busy", 0.001}, {"busy", 0.01}, {"sleep", 0.01},
+      {"bimodal", 0.002},
+  };
+  const char* engines[] = {"posix_spawn", "fork"};
+  constexpr int SAMPLES = 30;
+
+  MetricPrefix scale = config.use_ascii ? ascii_scales[1] : unicode_scales[1];
+  const char* plus_minus = config.use_ascii ? "+/- " : "±";
+
+  Table table({"Target", "Engine", "Nominal", "Mean", "Overhead", "Jitter",
+               "Shape"});
+  int row = 0;
+
+  for (const Synthetic& synthetic : synthetics) {
+    std::ostringstream oss;
+    oss << synthetic.seconds;
+    string duration = oss.str();
+    vector<const char*> args = {self.c_str(), "--synthetic", synthetic.kind,
+                                duration.c_str()};
+
+    for (const char* engine : engines) {
+      Target target(args);
+      bool fork = string(engine) == "fork";
+      for (int i = 0; i < SAMPLES + 1; ++i) {
+        // The first execution is a warmup
+        if (fork)
+          target.execute(i > 0, [](pid_t) {});
+        else
+          target.execute(i > 0);
+      }
+
+      const vector<double>& samples = target.time_samples();
+      DataSet set(samples, config.outliers);
+      Bimodality modes(samples);
+
+      double nominal = synthetic.seconds;
+      if (string(synthetic.kind) == "bimodal")
+        nominal *= 2;
+
+      table.push(0, string(synthetic.kind) + ' ' + duration);
+      table.push(1, engine);
+      table.push(2, format(nominal, scale) + 's');
+      table.push(3, format(set.mean, scale) + 's');
+      table.push(4, format(set.mean - nominal, scale) + 's');
+      table.push(5, plus_minus + format(set.sd, scale) + 's');
+      table.push(6, modes.bimodal ? "bimodal" : "");
+      table.fill_row(row++);
+    }
+  }
+
+  table.print();
+
+  // A/A comparisons of the same command, interleaved as the sampler does
+  constexpr int COMPARISONS = 20;
+  vector<const char*> args = {self.c_str(), "--synthetic", "busy", "0.001"};
+  int positives = 0;
+  for (int c = 0; c < COMPARISONS; ++c) {
+    vector<Target> targets = {Target(args), Target(args)};
+    for (int i = 0; i < 10; ++i) {
+      targets[0].execute();
+      targets[1].execute();
+    }
+    DataSet a(targets[0].time_samples(), config.outliers);
+    DataSet b(targets[1].time_samples(), config.outliers);
+    positives += ttest_lower_bound(a, b, config.confidence) > 0;
+  }
+
+  // Same 4 sigma margin as the simulated A/A comparisons
+  double alpha = 1. - config.confidence;
+  double margin = 4. * sqrt(alpha * (1 - alpha) / COMPARISONS);
+  cout << endl;
+  SelfCheck check;
+  check.expect_range("A/A of 'busy 0.001'", 0, alpha + margin,
+                     double(positives) / COMPARISONS);
+  return check.finish();
+}
+
+// Self validation of the harness: statistics against reference values, and
+// the timing floor of the sampler on calibrated synthetic targets.
+//
+// Returns the number of failed checks.
+inline int run_self_check(const Config& config) {
+  char self[PATH_MAX];
+  ssize_t length = readlink("/proc/self/exe", self, sizeof(self) - 1);
+  if (length < 0) {
+    perror("/proc/self/exe");
+    exit(1);
+  }
+  self[length] = '\0';
+
+  cout << "Statistics:" << endl;
+  int failures = check_statistics(config.confidence);
+
+  cout << endl << "Harness:" << endl;
+  failures += check_harness(config, self);
+
+  return failures;
+}
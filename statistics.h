@@ -1,6 +1,7 @@
 #pragma once
 #include <algorithm>
 #include <cmath>
+#include <optional>
 #include <vector>
 #include "config.h"
 #include "t_quantile.h"
@@ -48,6 +49,215 @@ inline void removeOutliersIQR(vector<double>& data) {
              data.end());
 }
 
+// Clamp the elements outside of the IQR bounds to the bounds, keeping the
+// original order of the data
+inline void clampOutliersIQR(vector<double>& data) {
+  double Q1, Q3;
+  vector<double> sorted = data;
+  calculateQuartiles(sorted, Q1, Q3);
+
+  double IQR = Q3 - Q1;
+  double lower_bound = Q1 - 1.5 * IQR;
+  double upper_bound = Q3 + 1.5 * IQR;
+
+  for (double& x : data)
+    x = clamp(x, lower_bound, upper_bound);
+}
+
+// Marginal Standard Error Rule (MSER-5) for the end of a warmup transient.
+//
+// The series is grouped in batches of 5 (of 1 under 100 samples, where
+// batching would leave too few candidates) and the truncation point d is the
+// one minimizing the squared standard error of the remaining batch means:
+//   MSER(d) = sum_{j>=d} (z_j - mean_d)^2 / (k - d)^2
+// Only the first half of the series is considered as a candidate. Samples are
+// clamped to the IQR fences first, so isolated spikes do not drag the
+// truncation point.
+//
+// Returns the number of leading elements of the series to discard.
+inline size_t mser_truncation(const vector<double>& series) {
+  size_t batch = series.size() >= 100 ? 5 : 1;
+  size_t k = series.size() / batch;
+  if (k < 4)
+    return 0;
+
+  vector<double> clamped = series;
+  clampOutliersIQR(clamped);
+
+  vector<double> z(k, 0.);
+  for (size_t j = 0; j < k; ++j) {
+    for (size_t i = 0; i < batch; ++i)
+      z[j] += clamped[j * batch + i];
+    z[j] /= batch;
+  }
+
+  // Suffix sums of z and z^2 to evaluate every candidate in O(k)
+  vector<double> sum(k + 1, 0.), sum_sq(k + 1, 0.);
+  for (size_t j = k; j-- > 0;) {
+    sum[j] = sum[j + 1] + z[j];
+    sum_sq[j] = sum_sq[j + 1] + sq(z[j]);
+  }
+
+  size_t best_d = 0;
+  double best = INFINITY;
+  for (size_t d = 0; d <= k / 2; ++d) {
+    double m = k - d;
+    double ss = sum_sq[d] - sq(sum[d]) / m;
+    double mser = ss / sq(m);
+    if (mser < best) {
+      best = mser;
+      best_d = d;
+    }
+  }
+
+  return best_d * batch;
+}
+
+// Cumulative sums of x and x^2. The sum of squared deviations of the range
+// [a, b) is obtained in O(1).
+struct PrefixSums {
+  vector<double> sum, sum_sq;
+
+  PrefixSums(const vector<double>& data)
+      : sum(data.size() + 1, 0.), sum_sq(data.size() + 1, 0.) {
+    for (size_t i = 0; i < data.size(); ++i) {
+      sum[i + 1] = sum[i] + data[i];
+      sum_sq[i + 1] = sum_sq[i] + sq(data[i]);
+    }
+  }
+
+  double mean(size_t a, size_t b) const { return (sum[b] - sum[a]) / (b - a); }
+
+  double cost(size_t a, size_t b) const {
+    return sum_sq[b] - sum_sq[a] - sq(sum[b] - sum[a]) / (b - a);
+  }
+};
+
+inline void binary_segmentation(const PrefixSums& sums,
+                                size_t a,
+                                size_t b,
+                                double penalty,
+                                size_t min_segment,
+                                vector<size_t>& changepoints) {
+  if (b - a < 2 * min_segment)
+    return;
+
+  double total = sums.cost(a, b);
+  double best_gain = 0;
+  size_t best_t = 0;
+  for (size_t t = a + min_segment; t <= b - min_segment; ++t) {
+    double gain = total - sums.cost(a, t) - sums.cost(t, b);
+    if (gain > best_gain) {
+      best_gain = gain;
+      best_t = t;
+    }
+  }
+
+  if (best_gain <= penalty)
+    return;
+
+  binary_segmentation(sums, a, best_t, penalty, min_segment, changepoints);
+  changepoints.push_back(best_t);
+  binary_segmentation(sums, best_t, b, penalty, min_segment, changepoints);
+}
+
+// Detect shifts of the mean in a time ordered series with binary
+// segmentation. The noise level is estimated from the mean absolute
+// difference of consecutive samples, which is barely affected by a few shifts
+// and still sees the spread of an alternating bimodal series, and each split
+// must pay a BIC-like penalty of 3 sigma^2 log(n).
+// Adjacent segments whose means differ less than `min_shift` (relative to the
+// mean of the series) are merged back: they are statistically real on a quiet
+// machine but not worth a warning.
+//
+// Returns the sorted indices where a new segment starts.
+inline vector<size_t> changepoints(const vector<double>& series,
+                                   double min_shift = 0.05,
+                                   size_t min_segment = 5) {
+  vector<size_t> result;
+  if (series.size() < 2 * min_segment)
+    return result;
+
+  vector<double> clamped = series;
+  clampOutliersIQR(clamped);
+
+  double abs_diff = 0;
+  for (size_t i = 1; i < clamped.size(); ++i)
+    abs_diff += fabs(clamped[i] - clamped[i - 1]);
+  abs_diff /= clamped.size() - 1;
+  double sigma = abs_diff * sqrt(M_PI) / 2.;
+
+  PrefixSums sums(clamped);
+  double penalty = 3. * sq(sigma) * log(double(series.size()));
+  binary_segmentation(sums, 0, clamped.size(), penalty, min_segment, result);
+
+  min_shift *= sums.mean(0, clamped.size());
+  while (!result.empty()) {
+    size_t closest = 0;
+    double closest_shift = INFINITY;
+    for (size_t k = 0; k < result.size(); ++k) {
+      size_t a = k == 0 ? 0 : result[k - 1];
+      size_t b = k + 1 == result.size() ? clamped.size() : result[k + 1];
+      double shift = fabs(sums.mean(a, result[k]) - sums.mean(result[k], b));
+      if (shift < closest_shift) {
+        closest_shift = shift;
+        closest = k;
+      }
+    }
+
+    if (closest_shift >= min_shift)
+      break;
+    result.erase(result.begin() + closest);
+  }
+
+  return result;
+}
+
+// Bimodality test on the distribution of the samples.
+//
+// The sorted data is split in the two groups that minimize the within-group
+// sum of squares (1D 2-means). The distribution is considered bimodal when
+// both groups are well separated and the smallest one holds at least
+// `min_share` of the samples, so that a handful of spikes is not reported as
+// a second mode.
+//
+// Splitting a single normal distribution this way already gives an Ashman's
+// D of ~2.7, so the usual D > 2 criterion is raised to D > 4.
+struct Bimodality {
+  double threshold = NAN;  // Split value between the two modes
+  double ashman_d = 0;
+  bool bimodal = false;
+
+  Bimodality(const vector<double>& data, double min_share = 0.1) {
+    vector<double> v = data;
+    sort(v.begin(), v.end());
+
+    size_t n = v.size();
+    size_t min_size = max<size_t>(5, ceil(min_share * n));
+    if (n < 2 * min_size)
+      return;
+
+    PrefixSums sums(v);
+    size_t best_t = 0;
+    double best_cost = INFINITY;
+    for (size_t t = min_size; t <= n - min_size; ++t) {
+      double cost = sums.cost(0, t) + sums.cost(t, n);
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_t = t;
+      }
+    }
+
+    double var1 = sums.cost(0, best_t) / (best_t - 1);
+    double var2 = sums.cost(best_t, n) / (n - best_t - 1);
+    double diff = sums.mean(best_t, n) - sums.mean(0, best_t);
+
+    threshold = (v[best_t - 1] + v[best_t]) / 2.;
+    ashman_d = sqrt(2.) * diff / sqrt(var1 + var2);
+    bimodal = ashman_d > 4.;
+  }
+};
+
 struct DataSet {
   double mean;
   double sd;
@@ -102,3 +312,94 @@ inline double ttest_lower_bound(DataSet& x, DataSet& y, double conf) {
 
   return lower_bound;
 }
+
+// Two sided Welch's t-test.
+// in R: t.test(arr1, arr2)$p.value
+inline double ttest_p_value(const DataSet& x, const DataSet& y) {
+  double x_sem = sq(x.sd) / x.n;
+  double y_sem = sq(y.sd) / y.n;
+
+  double se = sqrt(x_sem + y_sem);
+  double df =
+      sq(x_sem + y_sem) / (sq(x_sem) / (x.n - 1) + sq(y_sem) / (y.n - 1));
+
+  if (se == 0)
+    return x.mean == y.mean ? 1. : 0.;
+
+  double t = fabs(x.mean - y.mean) / se;
+  return min(1., 2. * (1. - student_t_cdf(t, df)));
+}
+
+// Holm-Bonferroni step-down correction of a family of p-values.
+// in R: p.adjust(p, "holm")
+inline vector<double> holm_correction(const vector<double>& p) {
+  size_t m = p.size();
+  vector<size_t> order(m);
+  for (size_t i = 0; i < m; ++i)
+    order[i] = i;
+  sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return p[a] < p[b];
+  });
+
+  vector<double> adjusted(m);
+  double running_max = 0;
+  for (size_t k = 0; k < m; ++k) {
+    running_max = max(running_max, min(1., (m - k) * p[order[k]]));
+    adjusted[order[k]] = running_max;
+  }
+  return adjusted;
+}
+
+// Benjamini-Hochberg step-up correction (false discovery rate).
+// in R: p.adjust(p, "BH")
+inline vector<double> benjamini_hochberg_correction(const vector<double>& p) {
+  size_t m = p.size();
+  vector<size_t> order(m);
+  for (size_t i = 0; i < m; ++i)
+    order[i] = i;
+  sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return p[a] < p[b];
+  });
+
+  vector<double> adjusted(m);
+  double running_min = 1;
+  for (size_t k = m; k-- > 0;) {
+    running_min = min(running_min, m * p[order[k]] / (k + 1));
+    adjusted[order[k]] = running_min;
+  }
+  return adjusted;
+}
+
+// Samples per target needed so that ttest_lower_bound(x, y, conf) is
+// positive with probability `power` when the real difference of the means is
+// `effect`. Solves n = (t_conf + t_power)^2 (sd_x^2 + sd_y^2) / effect^2,
+// iterating because the degrees of freedom depend on n.
+//
+// Returns nullopt when the count is not finite or beyond any feasible run.
+inline optional<long> required_samples(const DataSet& x,
+                                       const DataSet& y,
+                                       double effect,
+                                       double conf,
+                                       double power) {
+  constexpr double MAX_SAMPLES = 1e12;
+
+  double var = sq(x.sd) + sq(y.sd);
+  double var_sq = sq(sq(x.sd)) + sq(sq(y.sd));
+  if (var == 0)
+    return 2;
+
+  long n = 2;
+  for (int i = 0; i < 50; ++i) {
+    double df = var_sq > 0 ? sq(var) * (n - 1) / var_sq : n - 1;
+    double t = t_quantile(conf, df) + t_quantile(power, df);
+    double needed = ceil(sq(t) * var / sq(effect));
+    if (!isfinite(needed) || needed > MAX_SAMPLES)
+      return nullopt;
+
+    long next = max(2L, long(needed));
+    if (next == n)
+      break;
+    n = next;
+  }
+  return n;
+}
@@ -61,7 +61,33 @@ inline double incbeta(double a, double b, double x) {
   return 1.0 / 0.0; /*Needed more loops, did not converge.*/
 }
 
+// Above this many degrees of freedom the incomplete beta function does not
+// converge around the median, and the asymptotic expansions are exact to
+// double precision anyway.
+#define LARGE_DF 1.0e4
+
+inline double normal_cdf(double z) {
+  return 0.5 * std::erfc(-z / std::sqrt(2.0));
+}
+
+// Newton-Raphson method to find the standard normal quantile
+inline double normal_quantile(double alpha) {
+  double z = 0.0;
+  for (int i = 0; i < 50; ++i) {
+    double f = normal_cdf(z) - alpha;
+    if (std::abs(f) < 1e-15)
+      break;
+    z -= f / (std::exp(-0.5 * z * z) / std::sqrt(2.0 * M_PI));
+  }
+  return z;
+}
+
 inline double student_t_cdf(double t, double v) {
+  // Fisher's normalizing transformation, error O(1/v^2)
+  if (v >= LARGE_DF)
+    return normal_cdf(t * (1.0 - 1.0 / (4.0 * v)) /
+                      std::sqrt(1.0 + t * t / (2.0 * v)));
+
   double x = (t + sqrt(t * t + v)) / (2.0 * sqrt(t * t + v));
   double prob = incbeta(v / 2.0, v / 2.0, x);
   return prob;
@@ -83,6 +109,16 @@ inline double t_quantile(double alpha,
   if (df <= 0)
     return std::numeric_limits<double>::quiet_NaN();
 
+  // Cornish-Fisher expansion around the normal quantile
+  if (df >= LARGE_DF) {
+    double z = normal_quantile(alpha);
+    double z2 = z * z;
+    double g1 = (z2 + 1.0) * z / 4.0;
+    double g2 = ((5.0 * z2 + 16.0) * z2 + 3.0) * z / 96.0;
+    double g3 = (((3.0 * z2 + 19.0) * z2 + 17.0) * z2 - 15.0) * z / 384.0;
+    return z + g1 / df + g2 / (df * df) + g3 / (df * df * df);
+  }
+
   double t = 0.0;  // Initial guess
   for (int i = 0; i < max_iter; ++i) {
     double f = student_t_cdf(t, df) - alpha;